@@ -0,0 +1,228 @@
+#include "budget.h"
+
+#include <poser/core.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#define HIGHMARK(l) ((l) / 8 * 7)
+#define LOWMARK(l) ((l) / 4 * 3)
+#define WAKECHUNK 16384
+
+struct Budget
+{
+    size_t limit;
+    size_t used;
+    size_t inflight;
+    size_t pending;
+};
+
+typedef struct WaiterList
+{
+    BudgetWaiter *first;
+    BudgetWaiter *last;
+} WaiterList;
+
+static Budget global;
+static WaiterList waiting;
+static WaiterList woken;
+static int paused;
+
+static int below(const Budget *self, size_t mark)
+{
+    /* with no woken waiter outstanding, always let one make progress */
+    return !self->limit || self->inflight + self->pending < mark
+	|| !self->pending;
+}
+
+/* everything held counts for admitting new clients ... */
+static int exhausted(const Budget *self)
+{
+    return self->limit && self->used + self->pending
+	>= HIGHMARK(self->limit);
+}
+
+/* ... but only relayed data for pausing reads, as that's all pausing
+ * can free */
+static int congested(const Budget *self)
+{
+    return self->limit && self->inflight + self->pending
+	>= HIGHMARK(self->limit);
+}
+
+static void logstate(void)
+{
+    int cong = congested(&global);
+    if (cong == paused) return;
+    paused = cong;
+    if (paused)
+    {
+	PSC_Log_fmt(PSC_L_WARNING, "Tlsc: memory budget exhausted "
+		"(%zu of %zu bytes in flight), pausing",
+		global.inflight, global.limit);
+    }
+    else
+    {
+	PSC_Log_fmt(PSC_L_INFO, "Tlsc: memory budget available "
+		"(%zu of %zu bytes in flight), resuming",
+		global.inflight, global.limit);
+    }
+}
+
+static void linkwaiter(WaiterList *list, BudgetWaiter *w)
+{
+    w->prev = list->last;
+    w->next = 0;
+    if (list->last) list->last->next = w;
+    else list->first = w;
+    list->last = w;
+}
+
+static void unlinkwaiter(WaiterList *list, BudgetWaiter *w)
+{
+    if (w->prev) w->prev->next = w->next;
+    else list->first = w->next;
+    if (w->next) w->next->prev = w->prev;
+    else list->last = w->prev;
+    w->prev = 0;
+    w->next = 0;
+}
+
+static void wake(void)
+{
+    if (!waiting.first || !below(&global, LOWMARK(global.limit))) return;
+    while (below(&global, HIGHMARK(global.limit)))
+    {
+	BudgetWaiter *w = waiting.first;
+	while (w && w->budget
+		&& !below(w->budget, LOWMARK(w->budget->limit))) w = w->next;
+	if (!w) break;
+	unlinkwaiter(&waiting, w);
+	w->waiting = 0;
+	linkwaiter(&woken, w);
+	w->reserved = WAKECHUNK;
+	global.pending += w->reserved;
+	if (w->budget) w->budget->pending += w->reserved;
+	w->handler(w->obj);
+    }
+}
+
+static void eventsdone(void *receiver, void *sender, void *args)
+{
+    (void)receiver;
+    (void)sender;
+    (void)args;
+
+    /* a woken waiter that didn't receive anything in this loop iteration
+     * must not keep its reservation, or it could block all others */
+    while (woken.first) BudgetWaiter_settle(woken.first);
+    wake();
+    logstate();
+}
+
+SOLOCAL void Budget_init(size_t limit)
+{
+    memset(&global, 0, sizeof global);
+    global.limit = limit;
+    PSC_Event_register(PSC_Service_eventsDone(), 0, eventsdone, 0);
+}
+
+SOLOCAL void Budget_done(void)
+{
+    PSC_Event_unregister(PSC_Service_eventsDone(), 0, eventsdone, 0);
+}
+
+SOLOCAL Budget *Budget_create(size_t limit)
+{
+    Budget *self = PSC_malloc(sizeof *self);
+    memset(self, 0, sizeof *self);
+    self->limit = limit;
+    return self;
+}
+
+SOLOCAL void Budget_charge(Budget *self, size_t size)
+{
+    global.used += size;
+    global.inflight += size;
+    if (self)
+    {
+	self->used += size;
+	self->inflight += size;
+    }
+    logstate();
+}
+
+SOLOCAL void Budget_release(Budget *self, size_t size)
+{
+    global.used -= size;
+    global.inflight -= size;
+    if (self)
+    {
+	self->used -= size;
+	self->inflight -= size;
+    }
+    wake();
+    logstate();
+}
+
+SOLOCAL void Budget_hold(Budget *self, size_t size)
+{
+    global.used += size;
+    if (self) self->used += size;
+}
+
+SOLOCAL void Budget_unhold(Budget *self, size_t size)
+{
+    global.used -= size;
+    if (self) self->used -= size;
+}
+
+SOLOCAL int Budget_exhausted(const Budget *self)
+{
+    return exhausted(&global) || (self && exhausted(self));
+}
+
+SOLOCAL int Budget_congested(const Budget *self)
+{
+    return congested(&global) || (self && congested(self));
+}
+
+SOLOCAL void Budget_destroy(Budget *self)
+{
+    free(self);
+}
+
+SOLOCAL void BudgetWaiter_init(BudgetWaiter *self, BudgetHandler handler,
+	void *obj)
+{
+    memset(self, 0, sizeof *self);
+    self->handler = handler;
+    self->obj = obj;
+}
+
+SOLOCAL void BudgetWaiter_wait(BudgetWaiter *self, Budget *budget)
+{
+    BudgetWaiter_settle(self);
+    self->budget = budget;
+    linkwaiter(&waiting, self);
+    self->waiting = 1;
+}
+
+SOLOCAL void BudgetWaiter_settle(BudgetWaiter *self)
+{
+    if (!self->reserved) return;
+    unlinkwaiter(&woken, self);
+    global.pending -= self->reserved;
+    if (self->budget) self->budget->pending -= self->reserved;
+    self->reserved = 0;
+}
+
+SOLOCAL void BudgetWaiter_cancel(BudgetWaiter *self)
+{
+    if (self->waiting)
+    {
+	unlinkwaiter(&waiting, self);
+	self->waiting = 0;
+    }
+    BudgetWaiter_settle(self);
+}
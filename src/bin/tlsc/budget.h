@@ -0,0 +1,40 @@
+#ifndef TLSC_BUDGET_H
+#define TLSC_BUDGET_H
+
+#include <poser/decl.h>
+
+#include <stddef.h>
+
+C_CLASS_DECL(Budget);
+
+typedef void (*BudgetHandler)(void *obj);
+
+typedef struct BudgetWaiter
+{
+    struct BudgetWaiter *prev;
+    struct BudgetWaiter *next;
+    Budget *budget;
+    BudgetHandler handler;
+    void *obj;
+    size_t reserved;
+    int waiting;
+} BudgetWaiter;
+
+void Budget_init(size_t limit);
+void Budget_done(void);
+Budget *Budget_create(size_t limit) ATTR_RETNONNULL;
+void Budget_charge(Budget *self, size_t size);
+void Budget_release(Budget *self, size_t size);
+void Budget_hold(Budget *self, size_t size);
+void Budget_unhold(Budget *self, size_t size);
+int Budget_exhausted(const Budget *self) ATTR_PURE;
+int Budget_congested(const Budget *self) ATTR_PURE;
+void Budget_destroy(Budget *self);
+
+void BudgetWaiter_init(BudgetWaiter *self, BudgetHandler handler, void *obj)
+    ATTR_NONNULL((1)) ATTR_NONNULL((2));
+void BudgetWaiter_wait(BudgetWaiter *self, Budget *budget) CMETHOD;
+void BudgetWaiter_settle(BudgetWaiter *self) CMETHOD;
+void BudgetWaiter_cancel(BudgetWaiter *self) CMETHOD;
+
+#endif
@@ -0,0 +1,150 @@
+#include "clienthello.h"
+
+#include <ctype.h>
+#include <string.h>
+
+#define RECHDRSZ 5
+#define HSHDRSZ 4
+#define MAXRECSZ 16384
+#define MAXHELLOSZ 16384
+#define MAXHELLORECS 64
+
+#define CT_HANDSHAKE 0x16
+#define HT_CLIENTHELLO 0x01
+#define EXT_SNI 0x0000
+#define EXT_ALPN 0x0010
+#define SNI_HOSTNAME 0x00
+
+static unsigned rd16(const uint8_t *p)
+{
+    return ((unsigned)p[0] << 8) | p[1];
+}
+
+static unsigned rd24(const uint8_t *p)
+{
+    return ((unsigned)p[0] << 16) | ((unsigned)p[1] << 8) | p[2];
+}
+
+static int copyname(char *dst, size_t dstsz, const uint8_t *src, size_t len)
+{
+    if (!len || len >= dstsz) return -1;
+    for (size_t i = 0; i < len; ++i)
+    {
+	if (!isgraph(src[i])) return -1;
+	dst[i] = tolower(src[i]);
+    }
+    dst[len] = 0;
+    return 0;
+}
+
+static int parsesni(const uint8_t *p, size_t len, char *sni, size_t snisz)
+{
+    if (len < 2 || rd16(p) != len - 2) return -1;
+    p += 2;
+    len -= 2;
+    while (len >= 3)
+    {
+	unsigned type = p[0];
+	size_t namelen = rd16(p+1);
+	if (len < 3 + namelen) return -1;
+	if (type == SNI_HOSTNAME) return copyname(sni, snisz, p+3, namelen);
+	p += 3 + namelen;
+	len -= 3 + namelen;
+    }
+    return len ? -1 : 0;
+}
+
+static int parsealpn(const uint8_t *p, size_t len, char *alpn, size_t alpnsz)
+{
+    if (len < 3 || rd16(p) != len - 2) return -1;
+    size_t protolen = p[2];
+    if (len < 3 + protolen) return -1;
+    return copyname(alpn, alpnsz, p+3, protolen);
+}
+
+SOLOCAL int ClientHello_parse(const uint8_t *buf, size_t len,
+	char *sni, size_t snisz, char *alpn, size_t alpnsz)
+{
+    if (snisz) *sni = 0;
+    if (alpnsz) *alpn = 0;
+
+    /* the ClientHello may be fragmented into several records */
+    uint8_t msg[HSHDRSZ + MAXHELLOSZ];
+    size_t msglen = 0;
+    size_t needed = HSHDRSZ;
+    for (int recs = 0; msglen < needed; ++recs)
+    {
+	if (recs == MAXHELLORECS) return -1;
+	if (len >= 1 && buf[0] != CT_HANDSHAKE) return -1;
+	if (len >= 2 && buf[1] != 3) return -1;
+	if (len < RECHDRSZ) return 0;
+	size_t reclen = rd16(buf+3);
+	if (!reclen || reclen > MAXRECSZ) return -1;
+	if (len < RECHDRSZ + reclen) return 0;
+
+	const uint8_t *rec = buf + RECHDRSZ;
+	buf += RECHDRSZ + reclen;
+	len -= RECHDRSZ + reclen;
+	while (reclen && msglen < needed)
+	{
+	    size_t chunk = needed - msglen;
+	    if (chunk > reclen) chunk = reclen;
+	    memcpy(msg + msglen, rec, chunk);
+	    msglen += chunk;
+	    rec += chunk;
+	    reclen -= chunk;
+	    if (needed == HSHDRSZ && msglen == HSHDRSZ)
+	    {
+		if (msg[0] != HT_CLIENTHELLO) return -1;
+		needed += rd24(msg+1);
+		if (needed > sizeof msg) return -1;
+	    }
+	}
+    }
+
+    const uint8_t *p = msg + HSHDRSZ;
+    size_t left = needed - HSHDRSZ;
+
+    /* legacy_version, random */
+    if (left < 34) return -1;
+    p += 34;
+    left -= 34;
+
+    /* legacy_session_id */
+    if (left < 1 || left < 1U + p[0]) return -1;
+    left -= 1U + p[0];
+    p += 1U + p[0];
+
+    /* cipher_suites */
+    if (left < 2 || left < 2 + rd16(p)) return -1;
+    left -= 2 + rd16(p);
+    p += 2 + rd16(p);
+
+    /* legacy_compression_methods */
+    if (left < 1 || left < 1U + p[0]) return -1;
+    left -= 1U + p[0];
+    p += 1U + p[0];
+
+    /* extensions, optional for TLS < 1.3 */
+    if (!left) return 1;
+    if (left < 2 || left < 2 + rd16(p)) return -1;
+    left = rd16(p);
+    p += 2;
+    while (left >= 4)
+    {
+	unsigned type = rd16(p);
+	size_t extlen = rd16(p+2);
+	if (left < 4 + extlen) return -1;
+	if (type == EXT_SNI && parsesni(p+4, extlen, sni, snisz) < 0)
+	{
+	    return -1;
+	}
+	if (type == EXT_ALPN && parsealpn(p+4, extlen, alpn, alpnsz) < 0)
+	{
+	    return -1;
+	}
+	p += 4 + extlen;
+	left -= 4 + extlen;
+    }
+    return left ? -1 : 1;
+}
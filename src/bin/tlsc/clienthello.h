@@ -0,0 +1,17 @@
+#ifndef TLSC_CLIENTHELLO_H
+#define TLSC_CLIENTHELLO_H
+
+#include <poser/decl.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* more data than this never completes a ClientHello */
+#define CLIENTHELLO_MAXSZ (16 * 1024 + 512)
+
+/* returns 1 on success, 0 if more data is needed, -1 on error */
+int ClientHello_parse(const uint8_t *buf, size_t len,
+	char *sni, size_t snisz, char *alpn, size_t alpnsz)
+    ATTR_NONNULL((1)) ATTR_NONNULL((3)) ATTR_NONNULL((5));
+
+#endif
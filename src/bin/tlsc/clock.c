@@ -0,0 +1,17 @@
+#include "clock.h"
+
+#include <poser/decl.h>
+
+#include <time.h>
+
+SOLOCAL uint64_t Clock_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000U + (uint64_t)ts.tv_nsec / 1000U;
+}
+
+SOLOCAL uint64_t Clock_ms(void)
+{
+    return Clock_us() / 1000U;
+}
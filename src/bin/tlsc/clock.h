@@ -0,0 +1,9 @@
+#ifndef TLSC_CLOCK_H
+#define TLSC_CLOCK_H
+
+#include <stdint.h>
+
+uint64_t Clock_us(void);
+uint64_t Clock_ms(void);
+
+#endif
@@ -25,6 +25,9 @@ struct Config
     const char *pidfile;
     long uid;
     long gid;
+    long rate;
+    long memlimit;
+    int lagthreshold;
     int daemonize;
     int numerichosts;
     int verbose;
@@ -37,9 +40,20 @@ struct TunnelConfig
     const char *remotehost;
     const char *certfile;
     const char *keyfile;
+    const char *sni;
+    long uprate;
+    long downrate;
+    long tunuprate;
+    long tundownrate;
+    long memlimit;
     int bindport;
     int remoteport;
     int blacklisthits;
+    int weight;
+    int conntimeout;
+    int hellotimeout;
+    int firstbytetimeout;
+    int idletimeout;
     int server;
     int noverify;
     PSC_Proto serverproto;
@@ -52,6 +66,8 @@ static int intArg(int *setting, char *op, int min, int max, int base, char **p)
     ATTR_NONNULL((1)) ATTR_NONNULL((2));
 static int longArg(long *setting, char *op)
     ATTR_NONNULL((1)) ATTR_NONNULL((2));
+static int scaledArg(long *setting, char *op)
+    ATTR_NONNULL((1)) ATTR_NONNULL((2));
 static int optArg(Config *config, char *args, int *idx, char *op)
     ATTR_NONNULL((1)) ATTR_NONNULL((2)) ATTR_NONNULL((3)) ATTR_NONNULL((4));
 static void usage(const char *prgname)
@@ -60,8 +76,9 @@ static void usage(const char *prgname)
 static void usage(const char *prgname)
 {
     fprintf(stderr,
-	    "Usage: %s [-fnv] [-b hits] [-g group] [-p pidfile] [-u user]\n"
-	    "       tunspec [tunspec ...]\n", prgname);
+	    "Usage: %s [-fnv] [-b hits] [-g group] [-l ms] [-m bytes]\n"
+	    "       [-p pidfile] [-r rate] [-u user] tunspec [tunspec ...]\n",
+	    prgname);
     fputs("\n\ttunspec        description of a tunnel in the format\n"
 	    "\t               host:port:remotehost[:remoteport][:k=v[:...]]\n"
 	    "\t               using these values:\n\n"
@@ -71,6 +88,12 @@ static void usage(const char *prgname)
 	    "\t\tremoteport  port of remote service, default: same as `port'\n"
 	    "\t\tk=v         key-value pair of additional tunnel options,\n"
 	    "\t\t            the following are available:\n"
+	    "\t\t  a=rate    limit the total bandwidth of all connections\n"
+	    "\t\t            of this tunnel to `rate' bytes per second in\n"
+	    "\t\t            each direction. `rate' may have a suffix of\n"
+	    "\t\t            k, m or g for multiples of 1024.\n"
+	    "\t\t  au=rate   like `a', only for data sent to the remote\n"
+	    "\t\t  ad=rate   like `a', only for data sent to the client\n"
 	    "\t\t  b=hits    a positive number enables blacklisting\n"
 	    "\t\t            specific socket addresses for `hits'\n"
 	    "\t\t            connection attempts after failure to connect\n"
@@ -79,17 +102,44 @@ static void usage(const char *prgname)
 	    "\t\t            required as well.\n"
 	    "\t\t  k=key     `key' is the key file for the certificate. When\n"
 	    "\t\t            given, the `c' option is required as well.\n"
+	    "\t\t  m=bytes   limit the memory used for connections of this\n"
+	    "\t\t            tunnel, see -m\n"
+	    "\t\t  n=name    route connections by the server name (SNI)\n"
+	    "\t\t            in the TLS ClientHello without terminating\n"
+	    "\t\t            TLS. All tunnels with this option and the\n"
+	    "\t\t            same host and port share one listener and\n"
+	    "\t\t            are tried in the order given. `name' may be\n"
+	    "\t\t            `*' to match any connection or start with\n"
+	    "\t\t            `*.' to match any subdomain. Can't be\n"
+	    "\t\t            combined with the `c', `k' and `s' options.\n"
 	    "\t\t  p=[4|6]   only use IPv4 or IPv6\n"
 	    "\t\t  pc=[4|6]  only use IPv4 or IPv6 when connecting as client\n"
 	    "\t\t  ps=[4|6]  only use IPv4 or IPv6 when listening as server\n"
+	    "\t\t  r=rate    limit the bandwidth of each connection to\n"
+	    "\t\t            `rate' bytes per second in each direction\n"
+	    "\t\t  ru=rate   like `r', only for data sent to the remote\n"
+	    "\t\t  rd=rate   like `r', only for data sent to the client\n"
 	    "\t\t  s=[0|1]   disable (0) or enable (1) server mode. In\n"
 	    "\t\t            client mode (default), the forwarded connection\n"
 	    "\t\t            uses TLS. In server mode, incoming connections\n"
 	    "\t\t            use TLS. When enabling server mode, the `c' and\n"
 	    "\t\t            `k' options are required to configure a\n"
 	    "\t\t            certificate.\n"
+	    "\t\t  tc=secs   timeout for connecting to the remote,\n"
+	    "\t\t            including the TLS handshake. After a\n"
+	    "\t\t            timeout with `b' also given, connecting is\n"
+	    "\t\t            retried twice to try other addresses.\n"
+	    "\t\t  tf=secs   timeout for receiving the first data from\n"
+	    "\t\t            the remote after connecting\n"
+	    "\t\t  th=secs   timeout for receiving the TLS ClientHello\n"
+	    "\t\t            from the client (only with `n')\n"
+	    "\t\t  ti=secs   close connections idle for `secs'\n"
+	    "\t\t            Timeouts default to 0 (none).\n"
 	    "\t\t  v=[0|1]   disable (0) or enable (1) server certificate\n"
 	    "\t\t            verification (default: enabled)\n"
+	    "\t\t  w=weight  weight of this tunnel (1 - 1000) for sharing\n"
+	    "\t\t            the global bandwidth limit (see -r),\n"
+	    "\t\t            default: 1\n"
 	    "\n"
 	    "\t               Example:\n"
 	    "\n"
@@ -101,13 +151,26 @@ static void usage(const char *prgname)
 	    "\t               Specific socket addresses of foo.example:443\n"
 	    "\t               will be blacklisted for 2 hits after a\n"
 	    "\t               connection error.\n"
-	    "\n"
-	    "\t-f             run in foreground, do not detach\n"
+	    "\n", stderr);
+    fputs("\t-f             run in foreground, do not detach\n"
 	    "\t-g group       group name/id to run as\n"
 	    "\t               (defaults to primary group of user, see -u)\n"
+	    "\t-l ms          watch the event loop and warn when it runs\n"
+	    "\t               late by `ms' milliseconds or more. With -v,\n"
+	    "\t               a histogram of the lag is logged every minute.\n"
+	    "\t-m bytes       limit the memory used for connections and\n"
+	    "\t               relayed data. When the limit is nearly\n"
+	    "\t               reached, new clients are rejected, and when\n"
+	    "\t               relayed data alone nearly reaches it, reading\n"
+	    "\t               from connections is paused. `bytes' may have\n"
+	    "\t               a suffix of k, m or g.\n"
 	    "\t-n             use numeric hosts only, do not attempt\n"
 	    "\t               to resolve addresses\n"
 	    "\t-p pidfile     use `pidfile' instead of " PIDFILE "\n"
+	    "\t-r rate        limit the total bandwidth of all tunnels to\n"
+	    "\t               `rate' bytes per second in each direction,\n"
+	    "\t               shared between tunnels according to their\n"
+	    "\t               weight (see w=weight above)\n"
 	    "\t-u user        user name/id to run as\n"
 	    "\t               (defaults to current user)\n"
 	    "\t-v             debug mode - will log [DEBUG] messages\n",
@@ -143,6 +206,36 @@ static int longArg(long *setting, char *op)
     return 0;
 }
 
+static int scaledArg(long *setting, char *op)
+{
+    char *endp;
+    errno = 0;
+    long val = strtol(op, &endp, 10);
+    if (errno == ERANGE || val < 0) return -1;
+    long mult = 1;
+    switch (*endp)
+    {
+	case 'g':
+	case 'G':
+	    mult <<= 10;
+	    ATTR_FALLTHROUGH;
+	case 'm':
+	case 'M':
+	    mult <<= 10;
+	    ATTR_FALLTHROUGH;
+	case 'k':
+	case 'K':
+	    mult <<= 10;
+	    ++endp;
+	    break;
+	default:
+	    break;
+    }
+    if (*endp || val > LONG_MAX / mult) return -1;
+    *setting = val * mult;
+    return 0;
+}
+
 static int optArg(Config *config, char *args, int *idx, char *op)
 {
     if (!*idx) return -1;
@@ -156,9 +249,21 @@ static int optArg(Config *config, char *args, int *idx, char *op)
 		config->gid = g->gr_gid;
 	    }
 	    break;
+	case 'l':
+	    if (intArg(&config->lagthreshold, op, 1, INT_MAX, 10, 0) < 0)
+	    {
+		return -1;
+	    }
+	    break;
+	case 'm':
+	    if (scaledArg(&config->memlimit, op) < 0) return -1;
+	    break;
 	case 'p':
 	    config->pidfile = op;
 	    break;
+	case 'r':
+	    if (scaledArg(&config->rate, op) < 0) return -1;
+	    break;
 	case 'u':
 	    if (longArg(&config->uid, op) < 0)
 	    {
@@ -234,7 +339,18 @@ static TunnelConfig *parseTunnel(char *arg)
 
     char *certfile = 0;
     char *keyfile = 0;
+    char *sni = 0;
+    long uprate = 0;
+    long downrate = 0;
+    long tunuprate = 0;
+    long tundownrate = 0;
+    long memlimit = 0;
     int blacklisthits = 0;
+    int weight = 1;
+    int conntimeout = 0;
+    int hellotimeout = 0;
+    int firstbytetimeout = 0;
+    int idletimeout = 0;
     int server = 0;
     int noverify = 0;
     PSC_Proto serverproto = PSC_P_ANY;
@@ -257,12 +373,32 @@ static TunnelConfig *parseTunnel(char *arg)
 
 	for (;;)
 	{
-	    if (!strcmp(k, "b"))
+	    if (*k == 'a' || *k == 'r')
+	    {
+		long rate;
+		if (scaledArg(&rate, v) < 0) return 0;
+		long *up = *k == 'a' ? &tunuprate : &uprate;
+		long *down = *k == 'a' ? &tundownrate : &downrate;
+		if (!k[1])
+		{
+		    *up = rate;
+		    *down = rate;
+		}
+		else if (!strcmp(k+1, "u")) *up = rate;
+		else if (!strcmp(k+1, "d")) *down = rate;
+		else return 0;
+	    }
+	    else if (!strcmp(k, "b"))
 	    {
 		if (intArg(&blacklisthits, v, 0, INT_MAX, 10, 0) < 0) return 0;
 	    }
 	    else if (!strcmp(k, "c")) certfile = v;
 	    else if (!strcmp(k, "k")) keyfile = v;
+	    else if (!strcmp(k, "m"))
+	    {
+		if (scaledArg(&memlimit, v) < 0) return 0;
+	    }
+	    else if (!strcmp(k, "n")) sni = v;
 	    else if (*k == 'p')
 	    {
 		PSC_Proto p = PSC_P_ANY;
@@ -284,12 +420,26 @@ static TunnelConfig *parseTunnel(char *arg)
 		else if (!strcmp(v, "1")) server = 1;
 		else return 0;
 	    }
+	    else if (*k == 't')
+	    {
+		int *timeout = 0;
+		if (!strcmp(k+1, "c")) timeout = &conntimeout;
+		else if (!strcmp(k+1, "f")) timeout = &firstbytetimeout;
+		else if (!strcmp(k+1, "h")) timeout = &hellotimeout;
+		else if (!strcmp(k+1, "i")) timeout = &idletimeout;
+		else return 0;
+		if (intArg(timeout, v, 0, INT_MAX, 10, 0) < 0) return 0;
+	    }
 	    else if (!strcmp(k, "v"))
 	    {
 		if (!strcmp(v, "0")) noverify = 1;
 		else if (!strcmp(v, "1")) noverify = 0;
 		else return 0;
 	    }
+	    else if (!strcmp(k, "w"))
+	    {
+		if (intArg(&weight, v, 1, 1000, 10, 0) < 0) return 0;
+	    }
 	    else return 0;
 	    if (!(opt = tuntok(0, ':'))) break;
 	    if (tunkv(opt, &k, &v) < 0) return 0;
@@ -298,7 +448,8 @@ optdone: ;
     }
 
     if ((server && !certfile) || (server && !keyfile)
-	    || (keyfile && !certfile) || (certfile && !keyfile)) return 0;
+	    || (keyfile && !certfile) || (certfile && !keyfile)
+	    || (sni && (server || certfile || !*sni))) return 0;
 
     TunnelConfig *tun = PSC_malloc(sizeof *tun);
     tun->next = 0;
@@ -306,9 +457,20 @@ optdone: ;
     tun->remotehost = remotehost;
     tun->certfile = certfile;
     tun->keyfile = keyfile;
+    tun->sni = sni;
     tun->bindport = bindport;
     tun->remoteport = remoteport;
+    tun->uprate = uprate;
+    tun->downrate = downrate;
+    tun->tunuprate = tunuprate;
+    tun->tundownrate = tundownrate;
+    tun->memlimit = memlimit;
     tun->blacklisthits = blacklisthits;
+    tun->weight = weight;
+    tun->conntimeout = conntimeout;
+    tun->hellotimeout = hellotimeout;
+    tun->firstbytetimeout = firstbytetimeout;
+    tun->idletimeout = idletimeout;
     tun->server = server;
     tun->noverify = noverify;
     tun->serverproto = serverproto;
@@ -324,7 +486,7 @@ SOLOCAL Config *Config_fromOpts(int argc, char **argv)
     int arg;
     int naidx = 0;
     char needargs[ARGBUFSZ];
-    const char onceflags[] = "fgnpuv";
+    const char onceflags[] = "fglmnpruv";
     char seen[sizeof onceflags - 1] = {0};
 
     Config *config = PSC_malloc(sizeof *config);
@@ -378,7 +540,10 @@ SOLOCAL Config *Config_fromOpts(int argc, char **argv)
 			break;
 
 		    case 'g':
+		    case 'l':
+		    case 'm':
 		    case 'p':
+		    case 'r':
 		    case 'u':
 			if (addArg(needargs, &naidx, *o) < 0) goto silenterror;
 			break;
@@ -448,6 +613,11 @@ SOLOCAL const char *TunnelConfig_keyfile(const TunnelConfig *self)
     return self->keyfile;
 }
 
+SOLOCAL const char *TunnelConfig_sni(const TunnelConfig *self)
+{
+    return self->sni;
+}
+
 SOLOCAL int TunnelConfig_bindport(const TunnelConfig *self)
 {
     return self->bindport;
@@ -463,6 +633,56 @@ SOLOCAL int TunnelConfig_blacklisthits(const TunnelConfig *self)
     return self->blacklisthits;
 }
 
+SOLOCAL long TunnelConfig_uprate(const TunnelConfig *self)
+{
+    return self->uprate;
+}
+
+SOLOCAL long TunnelConfig_downrate(const TunnelConfig *self)
+{
+    return self->downrate;
+}
+
+SOLOCAL long TunnelConfig_tunuprate(const TunnelConfig *self)
+{
+    return self->tunuprate;
+}
+
+SOLOCAL long TunnelConfig_tundownrate(const TunnelConfig *self)
+{
+    return self->tundownrate;
+}
+
+SOLOCAL long TunnelConfig_memlimit(const TunnelConfig *self)
+{
+    return self->memlimit;
+}
+
+SOLOCAL int TunnelConfig_weight(const TunnelConfig *self)
+{
+    return self->weight;
+}
+
+SOLOCAL int TunnelConfig_conntimeout(const TunnelConfig *self)
+{
+    return self->conntimeout;
+}
+
+SOLOCAL int TunnelConfig_hellotimeout(const TunnelConfig *self)
+{
+    return self->hellotimeout;
+}
+
+SOLOCAL int TunnelConfig_firstbytetimeout(const TunnelConfig *self)
+{
+    return self->firstbytetimeout;
+}
+
+SOLOCAL int TunnelConfig_idletimeout(const TunnelConfig *self)
+{
+    return self->idletimeout;
+}
+
 SOLOCAL int TunnelConfig_server(const TunnelConfig *self)
 {
     return self->server;
@@ -498,6 +718,21 @@ SOLOCAL long Config_gid(const Config *self)
     return self->gid;
 }
 
+SOLOCAL long Config_rate(const Config *self)
+{
+    return self->rate;
+}
+
+SOLOCAL long Config_memlimit(const Config *self)
+{
+    return self->memlimit;
+}
+
+SOLOCAL int Config_lagthreshold(const Config *self)
+{
+    return self->lagthreshold;
+}
+
 SOLOCAL int Config_daemonize(const Config *self)
 {
     return self->daemonize;
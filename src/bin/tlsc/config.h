@@ -15,9 +15,21 @@ const char *TunnelConfig_bindhost(const TunnelConfig *self) CMETHOD ATTR_PURE;
 const char *TunnelConfig_remotehost(const TunnelConfig *self) CMETHOD ATTR_PURE;
 const char *TunnelConfig_certfile(const TunnelConfig *self) CMETHOD ATTR_PURE;
 const char *TunnelConfig_keyfile(const TunnelConfig *self) CMETHOD ATTR_PURE;
+const char *TunnelConfig_sni(const TunnelConfig *self) CMETHOD ATTR_PURE;
 int TunnelConfig_bindport(const TunnelConfig *self) CMETHOD ATTR_PURE;
 int TunnelConfig_remoteport(const TunnelConfig *self) CMETHOD ATTR_PURE;
 int TunnelConfig_blacklisthits(const TunnelConfig *self) CMETHOD ATTR_PURE;
+long TunnelConfig_uprate(const TunnelConfig *self) CMETHOD ATTR_PURE;
+long TunnelConfig_downrate(const TunnelConfig *self) CMETHOD ATTR_PURE;
+long TunnelConfig_tunuprate(const TunnelConfig *self) CMETHOD ATTR_PURE;
+long TunnelConfig_tundownrate(const TunnelConfig *self) CMETHOD ATTR_PURE;
+long TunnelConfig_memlimit(const TunnelConfig *self) CMETHOD ATTR_PURE;
+int TunnelConfig_weight(const TunnelConfig *self) CMETHOD ATTR_PURE;
+int TunnelConfig_conntimeout(const TunnelConfig *self) CMETHOD ATTR_PURE;
+int TunnelConfig_hellotimeout(const TunnelConfig *self) CMETHOD ATTR_PURE;
+int TunnelConfig_firstbytetimeout(const TunnelConfig *self)
+    CMETHOD ATTR_PURE;
+int TunnelConfig_idletimeout(const TunnelConfig *self) CMETHOD ATTR_PURE;
 int TunnelConfig_server(const TunnelConfig *self) CMETHOD ATTR_PURE;
 int TunnelConfig_noverify(const TunnelConfig *self) CMETHOD ATTR_PURE;
 PSC_Proto TunnelConfig_serverproto(const TunnelConfig *self) CMETHOD ATTR_PURE;
@@ -25,6 +37,9 @@ PSC_Proto TunnelConfig_clientproto(const TunnelConfig *self) CMETHOD ATTR_PURE;
 const char *Config_pidfile(const Config *self) CMETHOD ATTR_PURE;
 long Config_uid(const Config *self) CMETHOD ATTR_PURE;
 long Config_gid(const Config *self) CMETHOD ATTR_PURE;
+long Config_rate(const Config *self) CMETHOD ATTR_PURE;
+long Config_memlimit(const Config *self) CMETHOD ATTR_PURE;
+int Config_lagthreshold(const Config *self) CMETHOD ATTR_PURE;
 int Config_daemonize(const Config *self) CMETHOD ATTR_PURE;
 int Config_numerichosts(const Config *self) CMETHOD ATTR_PURE;
 int Config_verbose(const Config *self) CMETHOD ATTR_PURE;
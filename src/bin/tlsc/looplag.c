@@ -0,0 +1,101 @@
+#include "looplag.h"
+#include "clock.h"
+
+#include <poser/core.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define LAGINTERVAL 100
+#define LAGREPORT 600
+#define LAGBUCKETS 12
+
+static PSC_Timer *timer;
+static uint64_t expected;
+static uint64_t maxlag;
+static unsigned hist[LAGBUCKETS];
+static unsigned samples;
+static int threshold;
+static int lagging;
+
+static void report(void)
+{
+    char buf[512];
+    size_t len = 0;
+
+    for (int i = 0; i < LAGBUCKETS; ++i)
+    {
+	if (i < LAGBUCKETS - 1)
+	{
+	    len += snprintf(buf + len, sizeof buf - len, " <%ums: %u",
+		    1U << i, hist[i]);
+	}
+	else
+	{
+	    len += snprintf(buf + len, sizeof buf - len, " >=%ums: %u",
+		    1U << (i - 1), hist[i]);
+	}
+    }
+    PSC_Log_fmt(PSC_L_DEBUG, "Tlsc: event loop lag of %u samples, "
+	    "max %llums:%s", samples, (unsigned long long)maxlag, buf);
+
+    memset(hist, 0, sizeof hist);
+    samples = 0;
+    maxlag = 0;
+}
+
+static void start(void)
+{
+    expected = Clock_ms() + LAGINTERVAL;
+    PSC_Timer_start(timer, 0);
+}
+
+static void probe(void *receiver, void *sender, void *args)
+{
+    (void)receiver;
+    (void)sender;
+    (void)args;
+
+    uint64_t now = Clock_ms();
+    uint64_t lag = now > expected ? now - expected : 0;
+    start();
+
+    int bucket = 0;
+    while (bucket < LAGBUCKETS - 1 && lag >= (1U << bucket)) ++bucket;
+    ++hist[bucket];
+    if (lag > maxlag) maxlag = lag;
+
+    if (!lagging && lag >= (uint64_t)threshold)
+    {
+	lagging = 1;
+	PSC_Log_fmt(PSC_L_WARNING, "Tlsc: event loop lagging by %llums",
+		(unsigned long long)lag);
+    }
+    else if (lagging && lag < (uint64_t)threshold)
+    {
+	lagging = 0;
+	PSC_Log_fmt(PSC_L_INFO, "Tlsc: event loop lag back to %llums",
+		(unsigned long long)lag);
+    }
+
+    if (++samples == LAGREPORT) report();
+}
+
+SOLOCAL void LoopLag_init(int thresholdms)
+{
+    if (!thresholdms) return;
+    threshold = thresholdms;
+    timer = PSC_Timer_create();
+    PSC_Timer_setMs(timer, LAGINTERVAL);
+    PSC_Event_register(PSC_Timer_expired(timer), 0, probe, 0);
+    start();
+}
+
+SOLOCAL void LoopLag_done(void)
+{
+    if (!timer) return;
+    if (samples) report();
+    PSC_Timer_destroy(timer);
+    timer = 0;
+}
@@ -0,0 +1,7 @@
+#ifndef TLSC_LOOPLAG_H
+#define TLSC_LOOPLAG_H
+
+void LoopLag_init(int thresholdms);
+void LoopLag_done(void);
+
+#endif
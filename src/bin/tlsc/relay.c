@@ -0,0 +1,177 @@
+#include "relay.h"
+#include "clock.h"
+#include "wheel.h"
+
+#include <poser/core.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Dynamic TLS record sizing: after connecting or being idle for
+ * DYNRECIDLE ms, forward data in small records fitting a single TCP
+ * segment until DYNRECWARMUP bytes were sent, so the peer can start
+ * decrypting as soon as the first segment arrives. libposercore reads
+ * at most DYNRECMAXREAD bytes at once, so DYNRECSLICES records are
+ * enough for every read. */
+#define DYNRECSIZE 1360
+#define DYNRECMAXREAD 16384
+#define DYNRECSLICES ((DYNRECMAXREAD + DYNRECSIZE - 1) / DYNRECSIZE)
+#define DYNRECWARMUP (64 * 1024)
+#define DYNRECIDLE 1000
+
+/* Every direction has at most one chunk in flight: the source is only
+ * confirmed after the chunk was written, so reading the next one has to
+ * wait for another loop iteration. Therefore a busy connection can't
+ * monopolize the event loop. */
+typedef struct RelayDir
+{
+    Relay *relay;
+    PSC_Connection *src;
+    PSC_Connection *dst;
+    ShaperFlow *flow;
+    BudgetWaiter waiter;
+    void *sendid;
+    size_t inflight;
+    uint64_t received;
+    uint64_t lastsent;
+    size_t warm;
+    int tls;
+} RelayDir;
+
+struct Relay
+{
+    RelayDir dir[2];
+    Budget *budget;
+    uint64_t lastactive;
+};
+
+static size_t recordsize(RelayDir *dir, size_t size)
+{
+    if (!dir->tls) return size;
+    uint64_t now = Clock_ms();
+    if (now - dir->lastsent > DYNRECIDLE) dir->warm = 0;
+    if (dir->warm >= DYNRECWARMUP) return size;
+    dir->warm += size;
+    return DYNRECSIZE;
+}
+
+static void datareceived(void *receiver, void *sender, void *args)
+{
+    (void)sender;
+
+    RelayDir *dir = receiver;
+    const uint8_t *buf = PSC_EADataReceived_buf(args);
+    size_t size = PSC_EADataReceived_size(args);
+    PSC_EADataReceived_markHandling(args);
+    dir->received += size;
+    dir->relay->lastactive = Wheel_now();
+    BudgetWaiter_settle(&dir->waiter);
+    Budget_charge(dir->relay->budget, size);
+    dir->inflight = size;
+    if (dir->flow) ShaperFlow_consume(dir->flow, size);
+
+    size_t recsz = recordsize(dir, size);
+    for (int slices = 1; size > recsz && slices < DYNRECSLICES; ++slices)
+    {
+	if (PSC_Connection_sendAsync(dir->dst, buf, recsz, 0) < 0)
+	{
+	    PSC_Connection_close(dir->dst, 0);
+	    return;
+	}
+	buf += recsz;
+	size -= recsz;
+    }
+    dir->sendid = args;
+    PSC_Connection_sendAsync(dir->dst, buf, size, args);
+}
+
+static void proceed(void *obj)
+{
+    RelayDir *dir = obj;
+    if (dir->flow) ShaperFlow_done(dir->flow);
+    else PSC_Connection_confirmDataReceived(dir->src);
+}
+
+static void datasent(void *receiver, void *sender, void *args)
+{
+    (void)sender;
+
+    RelayDir *dir = receiver;
+
+    /* only the last record of a chunk carries the id, ignore anything
+     * else sent on the same connection */
+    if (!args || args != dir->sendid) return;
+    dir->sendid = 0;
+    dir->lastsent = Clock_ms();
+    Budget_release(dir->relay->budget, dir->inflight);
+    dir->inflight = 0;
+    if (Budget_congested(dir->relay->budget))
+    {
+	BudgetWaiter_wait(&dir->waiter, dir->relay->budget);
+    }
+    else proceed(dir);
+}
+
+static void initdir(RelayDir *dir, Relay *relay, PSC_Connection *src,
+	PSC_Connection *dst, ShaperFlow *flow, int tls)
+{
+    dir->relay = relay;
+    dir->src = src;
+    dir->dst = dst;
+    dir->flow = flow;
+    dir->tls = tls;
+    BudgetWaiter_init(&dir->waiter, proceed, dir);
+    PSC_Event_register(PSC_Connection_dataReceived(src), dir,
+	    datareceived, 0);
+    PSC_Event_register(PSC_Connection_dataSent(dst), dir, datasent, 0);
+}
+
+static void donedir(RelayDir *dir)
+{
+    PSC_Event_unregister(PSC_Connection_dataReceived(dir->src), dir,
+	    datareceived, 0);
+    PSC_Event_unregister(PSC_Connection_dataSent(dir->dst), dir,
+	    datasent, 0);
+    ShaperFlow_destroy(dir->flow);
+    BudgetWaiter_cancel(&dir->waiter);
+}
+
+SOLOCAL Relay *Relay_create(PSC_Connection *client, PSC_Connection *service,
+	Shaper *shaper, Budget *budget, long uprate, long downrate,
+	RelayFlags flags)
+{
+    Relay *self = PSC_malloc(sizeof *self);
+    memset(self, 0, sizeof *self);
+    self->budget = budget;
+    initdir(&self->dir[SD_UP], self, client, service,
+	    ShaperFlow_create(shaper, SD_UP, uprate, client),
+	    !!(flags & RF_TLSUP));
+    initdir(&self->dir[SD_DOWN], self, service, client,
+	    ShaperFlow_create(shaper, SD_DOWN, downrate, service),
+	    !!(flags & RF_TLSDOWN));
+    self->lastactive = Wheel_now();
+    return self;
+}
+
+SOLOCAL uint64_t Relay_lastActive(const Relay *self)
+{
+    return self->lastactive;
+}
+
+SOLOCAL uint64_t Relay_received(const Relay *self, ShaperDir dir)
+{
+    return self->dir[dir].received;
+}
+
+SOLOCAL void Relay_destroy(Relay *self)
+{
+    if (!self) return;
+    donedir(&self->dir[SD_UP]);
+    donedir(&self->dir[SD_DOWN]);
+
+    /* releasing may wake waiters, so only when neither direction can be
+     * woken any more */
+    Budget_release(self->budget, self->dir[SD_UP].inflight
+	    + self->dir[SD_DOWN].inflight);
+    free(self);
+}
@@ -0,0 +1,29 @@
+#ifndef TLSC_RELAY_H
+#define TLSC_RELAY_H
+
+#include "budget.h"
+#include "shaper.h"
+
+#include <poser/decl.h>
+
+#include <stdint.h>
+
+C_CLASS_DECL(PSC_Connection);
+C_CLASS_DECL(Relay);
+
+typedef enum RelayFlags
+{
+    RF_NONE	    = 0,
+    RF_TLSUP	    = 1 << 0,	/* connection to the remote uses TLS */
+    RF_TLSDOWN	    = 1 << 1	/* connection to the client uses TLS */
+} RelayFlags;
+
+Relay *Relay_create(PSC_Connection *client, PSC_Connection *service,
+	Shaper *shaper, Budget *budget, long uprate, long downrate,
+	RelayFlags flags)
+    ATTR_RETNONNULL ATTR_NONNULL((1)) ATTR_NONNULL((2)) ATTR_NONNULL((3));
+uint64_t Relay_lastActive(const Relay *self) CMETHOD ATTR_PURE;
+uint64_t Relay_received(const Relay *self, ShaperDir dir) CMETHOD ATTR_PURE;
+void Relay_destroy(Relay *self);
+
+#endif
@@ -0,0 +1,383 @@
+#include "shaper.h"
+#include "clock.h"
+
+#include <poser/core.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SHAPERTICK 10
+#define BURSTMIN 16384
+#define WEIGHTSCALE 1024
+
+typedef struct Bucket
+{
+    int64_t tokens;
+    int64_t reserved;
+    int64_t burst;
+    uint64_t last;
+    long rate;
+} Bucket;
+
+struct Shaper
+{
+    Bucket bucket[2];
+    uint64_t vtime[2];
+    ShaperFlow *parkedfirst[2];
+    ShaperFlow *parkedlast[2];
+    Shaper *blocknext[2];
+    size_t heappos[2];
+    int weight;
+};
+
+/* shapers with parked flows, a min-heap on their virtual time */
+typedef struct ShaperHeap
+{
+    Shaper **shapers;
+    size_t count;
+    size_t capa;
+} ShaperHeap;
+
+struct ShaperFlow
+{
+    ShaperFlow *prev;
+    ShaperFlow *next;
+    Shaper *shaper;
+    PSC_Connection *source;
+    Bucket bucket;
+    size_t lastsz;
+    size_t reserved;
+    ShaperDir dir;
+    int parked;
+};
+
+static Bucket global[2];
+static uint64_t vclock[2];
+static ShaperHeap parked[2];
+static PSC_Timer *timer;
+static int ticking;
+
+static void bucket_init(Bucket *self, long rate, uint64_t now)
+{
+    self->rate = rate;
+    self->burst = rate / 4 > BURSTMIN ? rate / 4 : BURSTMIN;
+    self->tokens = self->burst;
+    self->reserved = 0;
+    self->last = now;
+}
+
+static int64_t bucket_refill(const Bucket *self, uint64_t elapsed)
+{
+    /* split up, so even rates close to LONG_MAX can't overflow */
+    uint64_t rate = self->rate;
+    uint64_t secs = elapsed / 1000000U;
+    uint64_t usecs = elapsed % 1000000U;
+    if (secs > (uint64_t)self->burst / rate) return self->burst;
+    uint64_t refill = secs * rate + usecs * (rate / 1000000U)
+	+ usecs * (rate % 1000000U) / 1000000U;
+    return refill > (uint64_t)self->burst ? self->burst : (int64_t)refill;
+}
+
+static int bucket_ready(Bucket *self, uint64_t now)
+{
+    if (!self->rate) return 1;
+    int64_t refill = bucket_refill(self, now - self->last);
+    if (refill)
+    {
+	self->tokens += refill;
+	if (self->tokens > self->burst) self->tokens = self->burst;
+	self->last = now;
+    }
+    return self->tokens - self->reserved >= 0;
+}
+
+static void bucket_reserve(Bucket *self, int64_t size)
+{
+    if (self->rate) self->reserved += size;
+}
+
+static void bucket_consume(Bucket *self, int64_t reserved, int64_t size)
+{
+    if (!self->rate) return;
+    self->reserved -= reserved;
+    self->tokens -= size;
+}
+
+static int flow_ready(ShaperFlow *self, uint64_t now)
+{
+    return bucket_ready(&self->bucket, now)
+	&& bucket_ready(&self->shaper->bucket[self->dir], now)
+	&& bucket_ready(&global[self->dir], now);
+}
+
+static void flow_release(ShaperFlow *self)
+{
+    self->reserved = self->lastsz;
+    bucket_reserve(&self->bucket, self->reserved);
+    bucket_reserve(&self->shaper->bucket[self->dir], self->reserved);
+    bucket_reserve(&global[self->dir], self->reserved);
+    if (self->shaper->vtime[self->dir] > vclock[self->dir])
+    {
+	vclock[self->dir] = self->shaper->vtime[self->dir];
+    }
+    PSC_Connection_confirmDataReceived(self->source);
+}
+
+static void heap_place(ShaperDir dir, size_t pos, Shaper *shaper)
+{
+    parked[dir].shapers[pos-1] = shaper;
+    shaper->heappos[dir] = pos;
+}
+
+static void heap_up(ShaperDir dir, size_t pos)
+{
+    ShaperHeap *heap = &parked[dir];
+    Shaper *shaper = heap->shapers[pos-1];
+    while (pos > 1)
+    {
+	Shaper *parent = heap->shapers[pos/2-1];
+	if (parent->vtime[dir] <= shaper->vtime[dir]) break;
+	heap_place(dir, pos, parent);
+	pos /= 2;
+    }
+    heap_place(dir, pos, shaper);
+}
+
+static void heap_down(ShaperDir dir, size_t pos)
+{
+    ShaperHeap *heap = &parked[dir];
+    Shaper *shaper = heap->shapers[pos-1];
+    size_t child;
+    while ((child = 2 * pos) <= heap->count)
+    {
+	if (child < heap->count && heap->shapers[child]->vtime[dir]
+		< heap->shapers[child-1]->vtime[dir]) ++child;
+	if (shaper->vtime[dir] <= heap->shapers[child-1]->vtime[dir]) break;
+	heap_place(dir, pos, heap->shapers[child-1]);
+	pos = child;
+    }
+    heap_place(dir, pos, shaper);
+}
+
+static void heap_insert(Shaper *shaper, ShaperDir dir)
+{
+    ShaperHeap *heap = &parked[dir];
+    if (heap->count == heap->capa)
+    {
+	heap->capa = heap->capa ? 2 * heap->capa : 16;
+	heap->shapers = PSC_realloc(heap->shapers,
+		heap->capa * sizeof *heap->shapers);
+    }
+    heap_place(dir, ++heap->count, shaper);
+    heap_up(dir, heap->count);
+}
+
+static void heap_remove(Shaper *shaper, ShaperDir dir)
+{
+    ShaperHeap *heap = &parked[dir];
+    size_t pos = shaper->heappos[dir];
+    if (!pos) return;
+    shaper->heappos[dir] = 0;
+    Shaper *moved = heap->shapers[--heap->count];
+    if (pos > heap->count) return;
+    heap_place(dir, pos, moved);
+    heap_up(dir, pos);
+    heap_down(dir, moved->heappos[dir]);
+}
+
+static void tick(void *receiver, void *sender, void *args);
+
+static void updatetimer(void)
+{
+    int parkedflows = parked[SD_UP].count || parked[SD_DOWN].count;
+    if (parkedflows == ticking) return;
+    ticking = parkedflows;
+    if (!ticking)
+    {
+	PSC_Timer_stop(timer);
+	return;
+    }
+    if (!timer)
+    {
+	timer = PSC_Timer_create();
+	PSC_Timer_setMs(timer, SHAPERTICK);
+	PSC_Event_register(PSC_Timer_expired(timer), 0, tick, 0);
+    }
+    PSC_Timer_start(timer, 1);
+}
+
+static void flow_unpark(ShaperFlow *self)
+{
+    if (!self->parked) return;
+    Shaper *shaper = self->shaper;
+    ShaperDir dir = self->dir;
+    if (self->prev) self->prev->next = self->next;
+    else shaper->parkedfirst[dir] = self->next;
+    if (self->next) self->next->prev = self->prev;
+    else shaper->parkedlast[dir] = self->prev;
+    self->prev = 0;
+    self->next = 0;
+    self->parked = 0;
+    if (!shaper->parkedfirst[dir]) heap_remove(shaper, dir);
+}
+
+static void tickdir(ShaperDir dir, uint64_t now)
+{
+    ShaperHeap *heap = &parked[dir];
+    Shaper *blocked = 0;
+
+    /* visit every shaper at most once per tick, in order of virtual
+     * time */
+    while (heap->count && bucket_ready(&global[dir], now))
+    {
+	Shaper *shaper = heap->shapers[0];
+	heap_remove(shaper, dir);
+	ShaperFlow *next;
+	for (ShaperFlow *f = shaper->parkedfirst[dir]; f
+		&& bucket_ready(&shaper->bucket[dir], now)
+		&& bucket_ready(&global[dir], now); f = next)
+	{
+	    next = f->next;
+	    if (!bucket_ready(&f->bucket, now)) continue;
+	    flow_unpark(f);
+	    flow_release(f);
+	}
+	if (shaper->parkedfirst[dir])
+	{
+	    shaper->blocknext[dir] = blocked;
+	    blocked = shaper;
+	}
+    }
+
+    /* put back the shapers that still have to wait */
+    while (blocked)
+    {
+	Shaper *shaper = blocked;
+	blocked = shaper->blocknext[dir];
+	heap_insert(shaper, dir);
+    }
+}
+
+static void tick(void *receiver, void *sender, void *args)
+{
+    (void)receiver;
+    (void)sender;
+    (void)args;
+
+    uint64_t now = Clock_us();
+    tickdir(SD_UP, now);
+    tickdir(SD_DOWN, now);
+    updatetimer();
+}
+
+static void flow_park(ShaperFlow *self)
+{
+    Shaper *shaper = self->shaper;
+    ShaperDir dir = self->dir;
+
+    /* don't let a tunnel that was idle catch up on the others */
+    if (shaper->vtime[dir] < vclock[dir])
+    {
+	shaper->vtime[dir] = vclock[dir];
+	if (shaper->heappos[dir]) heap_down(dir, shaper->heappos[dir]);
+    }
+
+    self->prev = shaper->parkedlast[dir];
+    self->next = 0;
+    if (shaper->parkedlast[dir]) shaper->parkedlast[dir]->next = self;
+    else
+    {
+	shaper->parkedfirst[dir] = self;
+	heap_insert(shaper, dir);
+    }
+    shaper->parkedlast[dir] = self;
+    self->parked = 1;
+    updatetimer();
+}
+
+SOLOCAL void Shaper_init(long rate)
+{
+    uint64_t now = Clock_us();
+    bucket_init(&global[SD_UP], rate, now);
+    bucket_init(&global[SD_DOWN], rate, now);
+}
+
+SOLOCAL Shaper *Shaper_create(long uprate, long downrate, int weight)
+{
+    Shaper *self = PSC_malloc(sizeof *self);
+    memset(self, 0, sizeof *self);
+    uint64_t now = Clock_us();
+    bucket_init(&self->bucket[SD_UP], uprate, now);
+    bucket_init(&self->bucket[SD_DOWN], downrate, now);
+    self->weight = weight;
+    return self;
+}
+
+SOLOCAL void Shaper_destroy(Shaper *self)
+{
+    free(self);
+}
+
+SOLOCAL void Shaper_done(void)
+{
+    for (int dir = SD_UP; dir <= SD_DOWN; ++dir)
+    {
+	free(parked[dir].shapers);
+	memset(&parked[dir], 0, sizeof parked[dir]);
+    }
+    if (!timer) return;
+    PSC_Timer_destroy(timer);
+    timer = 0;
+    ticking = 0;
+}
+
+SOLOCAL ShaperFlow *ShaperFlow_create(Shaper *shaper, ShaperDir dir,
+	long rate, PSC_Connection *source)
+{
+    if (!rate && !shaper->bucket[dir].rate && !global[dir].rate) return 0;
+
+    ShaperFlow *self = PSC_malloc(sizeof *self);
+    memset(self, 0, sizeof *self);
+    bucket_init(&self->bucket, rate, Clock_us());
+    self->shaper = shaper;
+    self->source = source;
+    self->dir = dir;
+    return self;
+}
+
+SOLOCAL void ShaperFlow_consume(ShaperFlow *self, size_t size)
+{
+    bucket_consume(&self->bucket, self->reserved, size);
+    bucket_consume(&self->shaper->bucket[self->dir], self->reserved, size);
+    bucket_consume(&global[self->dir], self->reserved, size);
+    self->shaper->vtime[self->dir] += size * WEIGHTSCALE
+	/ self->shaper->weight;
+    if (self->shaper->heappos[self->dir])
+    {
+	heap_down(self->dir, self->shaper->heappos[self->dir]);
+    }
+    self->lastsz = size;
+    self->reserved = 0;
+}
+
+SOLOCAL void ShaperFlow_done(ShaperFlow *self)
+{
+    if (self->parked) return;
+
+    /* while others wait for the global limit, leave the order to tick() */
+    if (!(global[self->dir].rate && parked[self->dir].count)
+	    && flow_ready(self, Clock_us())) flow_release(self);
+    else flow_park(self);
+}
+
+SOLOCAL void ShaperFlow_destroy(ShaperFlow *self)
+{
+    if (!self) return;
+    flow_unpark(self);
+    updatetimer();
+    bucket_consume(&self->bucket, self->reserved, 0);
+    bucket_consume(&self->shaper->bucket[self->dir], self->reserved, 0);
+    bucket_consume(&global[self->dir], self->reserved, 0);
+    free(self);
+}
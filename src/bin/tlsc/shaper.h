@@ -0,0 +1,30 @@
+#ifndef TLSC_SHAPER_H
+#define TLSC_SHAPER_H
+
+#include <poser/decl.h>
+
+#include <stddef.h>
+
+C_CLASS_DECL(PSC_Connection);
+C_CLASS_DECL(Shaper);
+C_CLASS_DECL(ShaperFlow);
+
+typedef enum ShaperDir
+{
+    SD_UP,	/* client -> remote */
+    SD_DOWN	/* remote -> client */
+} ShaperDir;
+
+void Shaper_init(long rate);
+Shaper *Shaper_create(long uprate, long downrate, int weight)
+    ATTR_RETNONNULL;
+void Shaper_destroy(Shaper *self);
+void Shaper_done(void);
+
+ShaperFlow *ShaperFlow_create(Shaper *shaper, ShaperDir dir, long rate,
+	PSC_Connection *source) ATTR_NONNULL((1)) ATTR_NONNULL((4));
+void ShaperFlow_consume(ShaperFlow *self, size_t size) CMETHOD;
+void ShaperFlow_done(ShaperFlow *self) CMETHOD;
+void ShaperFlow_destroy(ShaperFlow *self);
+
+#endif
@@ -1,53 +1,76 @@
+#include "clienthello.h"
 #include "config.h"
+#include "looplag.h"
+#include "relay.h"
+#include "wheel.h"
 
 #include <poser/core.h>
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 
 #ifndef LOGIDENT
 #define LOGIDENT "tlsc"
 #endif
 
-#define SERVCHUNK 16
+#define MAXSNI 256
+#define MAXALPN 256
+#define CONNRETRIES 2
+
+/* estimated memory of a relayed connection pair in libposercore, and
+ * additionally in OpenSSL when one side uses TLS */
+#define CONNCOST (32 * 1024)
+#define TLSCOST (64 * 1024)
+#define SECS(s) ((uint64_t)(s) * (1000U / WHEELTICK))
+
+typedef struct Route
+{
+    struct Route *next;
+    const TunnelConfig *tc;
+    PSC_TcpClientOpts *clientopts;
+    Shaper *shaper;
+    Budget *budget;
+} Route;
 
 typedef struct ServCtx
 {
+    struct ServCtx *next;
     PSC_Server *server;
-    const TunnelConfig *tc;
+    Route *routes;
+    int hellotimeout;
+    int passthrough;
 } ServCtx;
 
+typedef enum ConnPhase
+{
+    CP_HELLO,
+    CP_CONNECT,
+    CP_FIRSTBYTE,
+    CP_IDLE
+} ConnPhase;
+
 typedef struct ConnCtx
 {
     PSC_Connection *client;
     PSC_Connection *service;
+    const ServCtx *srv;
+    const Route *route;
+    uint8_t *hello;
+    size_t hellosz;
+    size_t cost;
+    Relay *relay;
+    WheelTimer timeout;
     const char *chost;
     const char *shost;
+    ConnPhase phase;
+    int retries;
     int connected;
 } ConnCtx;
 
 static const Config *cfg;
 static ServCtx *servers = 0;
-static size_t servcapa = 0;
-static size_t servsize = 0;
-
-static void datareceived(void *receiver, void *sender, void *args)
-{
-    (void)sender;
-
-    PSC_Connection *c = receiver;
-    PSC_EADataReceived_markHandling(args);
-    PSC_Connection_sendAsync(c, PSC_EADataReceived_buf(args),
-	    PSC_EADataReceived_size(args), args);
-}
-
-static void datasent(void *receiver, void *sender, void *args)
-{
-    (void)sender;
-    (void)args;
-
-    PSC_Connection_confirmDataReceived(receiver);
-}
 
 static void logconnected(ConnCtx *ctx)
 {
@@ -72,6 +95,19 @@ static void nameresolved(void *receiver, void *sender, void *args)
     logconnected(ctx);
 }
 
+static void hellosent(void *receiver, void *sender, void *args)
+{
+    ConnCtx *ctx = receiver;
+    PSC_Connection *sv = sender;
+
+    if (args != ctx->hello) return;
+    PSC_Event_unregister(PSC_Connection_dataSent(sv), ctx, hellosent, 0);
+    Budget_unhold(0, ctx->hellosz);
+    free(ctx->hello);
+    ctx->hello = 0;
+    ctx->hellosz = 0;
+}
+
 static void connected(void *receiver, void *sender, void *args)
 {
     (void)args;
@@ -80,12 +116,29 @@ static void connected(void *receiver, void *sender, void *args)
     PSC_Connection *sv = sender;
     PSC_Connection *cl = ctx->client;
 
-    PSC_Event_register(PSC_Connection_dataReceived(cl), sv, datareceived, 0);
-    PSC_Event_register(PSC_Connection_dataReceived(sv), cl, datareceived, 0);
-    PSC_Event_register(PSC_Connection_dataSent(cl), sv, datasent, 0);
-    PSC_Event_register(PSC_Connection_dataSent(sv), cl, datasent, 0);
+    const TunnelConfig *tc = ctx->route->tc;
+    RelayFlags flags = RF_NONE;
+    if (!ctx->srv->passthrough)
+    {
+	flags = TunnelConfig_server(tc) ? RF_TLSDOWN : RF_TLSUP;
+    }
+    ctx->relay = Relay_create(cl, sv, ctx->route->shaper, ctx->route->budget,
+	    TunnelConfig_uprate(tc), TunnelConfig_downrate(tc), flags);
 
     ctx->connected = 1;
+    int firstbyte = TunnelConfig_firstbytetimeout(tc);
+    int idle = TunnelConfig_idletimeout(tc);
+    if (firstbyte)
+    {
+	ctx->phase = CP_FIRSTBYTE;
+	WheelTimer_arm(&ctx->timeout, SECS(firstbyte));
+    }
+    else
+    {
+	ctx->phase = CP_IDLE;
+	if (idle) WheelTimer_arm(&ctx->timeout, SECS(idle));
+	else WheelTimer_disarm(&ctx->timeout);
+    }
     if (Config_numerichosts(cfg))
     {
 	ctx->chost = PSC_Connection_remoteAddr(cl);
@@ -93,9 +146,29 @@ static void connected(void *receiver, void *sender, void *args)
     }
     logconnected(ctx);
 
+    /* sent with its own id, so it's freed as soon as it's written */
+    if (ctx->hello)
+    {
+	PSC_Event_register(PSC_Connection_dataSent(sv), ctx, hellosent, 0);
+	if (PSC_Connection_sendAsync(sv, ctx->hello, ctx->hellosz,
+		    ctx->hello) < 0)
+	{
+	    PSC_Connection_close(sv, 0);
+	    return;
+	}
+    }
     PSC_Connection_resume(cl);
 }
 
+static void deletectx(ConnCtx *ctx)
+{
+    WheelTimer_disarm(&ctx->timeout);
+    if (ctx->cost) Budget_unhold(ctx->route->budget, ctx->cost);
+    if (ctx->hello) Budget_unhold(0, ctx->hellosz);
+    free(ctx->hello);
+    free(ctx);
+}
+
 static void connclosed(void *receiver, void *sender, void *args)
 {
     ConnCtx *ctx = receiver;
@@ -106,12 +179,12 @@ static void connclosed(void *receiver, void *sender, void *args)
     PSC_Event_unregister(PSC_Connection_closed(c), ctx, connclosed, 0);
     if (args)
     {
-	PSC_Event_unregister(PSC_Connection_dataReceived(c), o,
-		datareceived, 0);
-	PSC_Event_unregister(PSC_Connection_dataReceived(o), c,
-		datareceived, 0);
-	PSC_Event_unregister(PSC_Connection_dataSent(c), o, datasent, 0);
-	PSC_Event_unregister(PSC_Connection_dataSent(o), c, datasent, 0);
+	Relay_destroy(ctx->relay);
+	if (ctx->hello)
+	{
+	    PSC_Event_unregister(PSC_Connection_dataSent(ctx->service), ctx,
+		    hellosent, 0);
+	}
 	const char *chost = PSC_Connection_remoteHost(c);
 	if (!chost) chost = PSC_Connection_remoteAddr(c);
 	const char *ohost = PSC_Connection_remoteHost(o);
@@ -126,7 +199,7 @@ static void connclosed(void *receiver, void *sender, void *args)
     }
 
     PSC_Connection_close(o, 0);
-    free(ctx);
+    deletectx(ctx);
 }
 
 static void svConnCreated(void *receiver, PSC_Connection *sv)
@@ -136,7 +209,7 @@ static void svConnCreated(void *receiver, PSC_Connection *sv)
     if (!sv)
     {
 	PSC_Connection_close(ctx->client, 0);
-	free(ctx);
+	deletectx(ctx);
 	return;
     }
 
@@ -150,6 +223,192 @@ static void svConnCreated(void *receiver, PSC_Connection *sv)
     PSC_Event_register(PSC_Connection_closed(ctx->client), ctx, connclosed, 0);
     PSC_Event_register(PSC_Connection_closed(sv), ctx, connclosed, 0);
     PSC_Event_register(PSC_Connection_connected(sv), ctx, connected, 0);
+
+    ctx->phase = CP_CONNECT;
+    int timeout = TunnelConfig_conntimeout(ctx->route->tc);
+    if (timeout) WheelTimer_arm(&ctx->timeout, SECS(timeout));
+}
+
+static int connectservice(ConnCtx *ctx)
+{
+    if (!ctx->cost)
+    {
+	ctx->cost = CONNCOST;
+	if (!ctx->srv->passthrough) ctx->cost += TLSCOST;
+	Budget_hold(ctx->route->budget, ctx->cost);
+    }
+    if (PSC_Connection_createTcpClientAsync(ctx->route->clientopts,
+		ctx, svConnCreated) < 0)
+    {
+	PSC_Connection_close(ctx->client, 0);
+	deletectx(ctx);
+	return -1;
+    }
+    return 0;
+}
+
+static void connecttimeout(ConnCtx *ctx)
+{
+    PSC_Connection *sv = ctx->service;
+
+    PSC_Log_fmt(PSC_L_INFO, "Tlsc: timeout connecting to %s:%d",
+	    TunnelConfig_remotehost(ctx->route->tc),
+	    TunnelConfig_remoteport(ctx->route->tc));
+    /* only with blacklisting, a retry can reach another address */
+    if (!TunnelConfig_blacklisthits(ctx->route->tc)
+	    || ctx->retries++ == CONNRETRIES)
+    {
+	PSC_Connection_close(sv, 1);
+	return;
+    }
+
+    PSC_Event_unregister(PSC_Connection_closed(ctx->client), ctx,
+	    connclosed, 0);
+    PSC_Event_unregister(PSC_Connection_closed(sv), ctx, connclosed, 0);
+    PSC_Event_unregister(PSC_Connection_connected(sv), ctx, connected, 0);
+    if (!Config_numerichosts(cfg))
+    {
+	PSC_Event_unregister(PSC_Connection_nameResolved(sv), ctx,
+		nameresolved, 0);
+    }
+    ctx->service = 0;
+    ctx->shost = 0;
+    PSC_Connection_close(sv, 1);
+    connectservice(ctx);
+}
+
+static void timedout(void *obj)
+{
+    ConnCtx *ctx = obj;
+    uint64_t lastactive;
+    int idle;
+
+    switch (ctx->phase)
+    {
+	case CP_HELLO:
+	    PSC_Log_msg(PSC_L_INFO, "Tlsc: timeout waiting for ClientHello");
+	    PSC_Connection_close(ctx->client, 0);
+	    break;
+
+	case CP_CONNECT:
+	    connecttimeout(ctx);
+	    break;
+
+	case CP_FIRSTBYTE:
+	    if (Relay_received(ctx->relay, SD_DOWN))
+	    {
+		ctx->phase = CP_IDLE;
+		if (TunnelConfig_idletimeout(ctx->route->tc)) timedout(ctx);
+		break;
+	    }
+	    PSC_Log_fmt(PSC_L_INFO, "Tlsc: timeout waiting for data from %s:%d",
+		    TunnelConfig_remotehost(ctx->route->tc),
+		    TunnelConfig_remoteport(ctx->route->tc));
+	    PSC_Connection_close(ctx->client, 0);
+	    break;
+
+	case CP_IDLE:
+	    idle = TunnelConfig_idletimeout(ctx->route->tc);
+	    lastactive = Relay_lastActive(ctx->relay);
+	    if (Wheel_now() - lastactive < SECS(idle))
+	    {
+		WheelTimer_arm(&ctx->timeout,
+			lastactive + SECS(idle) - Wheel_now());
+		break;
+	    }
+	    PSC_Log_msg(PSC_L_DEBUG, "Tlsc: closing idle connection");
+	    PSC_Connection_close(ctx->client, 0);
+	    break;
+    }
+}
+
+static const Route *findroute(const ServCtx *srv, const char *sni)
+{
+    for (const Route *r = srv->routes; r; r = r->next)
+    {
+	const char *name = TunnelConfig_sni(r->tc);
+	if (!strcmp(name, "*")) return r;
+	if (!*sni) continue;
+	if (!strcasecmp(name, sni)) return r;
+	const char *dot = strchr(sni, '.');
+	if (name[0] == '*' && name[1] == '.' && dot
+		&& !strcasecmp(name+1, dot)) return r;
+    }
+    return 0;
+}
+
+static void helloclosed(void *receiver, void *sender, void *args);
+
+static void helloreceived(void *receiver, void *sender, void *args)
+{
+    (void)sender;
+
+    ConnCtx *ctx = receiver;
+    PSC_Connection *cl = ctx->client;
+
+    size_t size = PSC_EADataReceived_size(args);
+    ctx->hello = PSC_realloc(ctx->hello, ctx->hellosz + size);
+    memcpy(ctx->hello + ctx->hellosz, PSC_EADataReceived_buf(args), size);
+    ctx->hellosz += size;
+    Budget_hold(0, size);
+
+    char sni[MAXSNI];
+    char alpn[MAXALPN];
+    int rc = ClientHello_parse(ctx->hello, ctx->hellosz,
+	    sni, sizeof sni, alpn, sizeof alpn);
+    if (!rc)
+    {
+	if (ctx->hellosz < CLIENTHELLO_MAXSZ) return;
+	PSC_Log_msg(PSC_L_DEBUG, "Tlsc: TLS ClientHello too large");
+	PSC_Connection_close(cl, 0);
+	return;
+    }
+
+    PSC_Event_unregister(PSC_Connection_dataReceived(cl), ctx,
+	    helloreceived, 0);
+    PSC_Event_unregister(PSC_Connection_closed(cl), ctx, helloclosed, 0);
+    PSC_Connection_pause(cl);
+    WheelTimer_disarm(&ctx->timeout);
+
+    if (rc < 0)
+    {
+	PSC_Log_msg(PSC_L_DEBUG, "Tlsc: cannot parse TLS ClientHello");
+	*sni = 0;
+    }
+    else
+    {
+	PSC_Log_fmt(PSC_L_DEBUG, "Tlsc: ClientHello for \"%s\", ALPN \"%s\"",
+		sni, alpn);
+    }
+    if (!(ctx->route = findroute(ctx->srv, sni)))
+    {
+	PSC_Log_fmt(PSC_L_INFO, "Tlsc: no route for \"%s\"", sni);
+	PSC_Connection_close(cl, 0);
+	deletectx(ctx);
+	return;
+    }
+    if (Budget_exhausted(ctx->route->budget))
+    {
+	PSC_Log_msg(PSC_L_DEBUG, "Tlsc: memory budget exhausted, "
+		"rejecting client");
+	PSC_Connection_close(cl, 0);
+	deletectx(ctx);
+	return;
+    }
+    connectservice(ctx);
+}
+
+static void helloclosed(void *receiver, void *sender, void *args)
+{
+    (void)args;
+
+    ConnCtx *ctx = receiver;
+    PSC_Connection *cl = sender;
+
+    PSC_Event_unregister(PSC_Connection_dataReceived(cl), ctx,
+	    helloreceived, 0);
+    PSC_Event_unregister(PSC_Connection_closed(cl), ctx, helloclosed, 0);
+    deletectx(ctx);
 }
 
 static void newclient(void *receiver, void *sender, void *args)
@@ -159,41 +418,76 @@ static void newclient(void *receiver, void *sender, void *args)
     ServCtx *ctx = receiver;
     PSC_Connection *cl = args;
 
-    PSC_Connection_pause(cl);
+    if (Budget_exhausted(ctx->passthrough ? 0 : ctx->routes->budget))
+    {
+	PSC_Log_msg(PSC_L_DEBUG, "Tlsc: memory budget exhausted, "
+		"rejecting client");
+	PSC_Connection_close(cl, 0);
+	return;
+    }
 
     ConnCtx *cctx = PSC_malloc(sizeof *cctx);
     memset(cctx, 0, sizeof *cctx);
     cctx->client = cl;
+    cctx->srv = ctx;
+    WheelTimer_init(&cctx->timeout, timedout, cctx);
 
-    PSC_TcpClientOpts *opts = PSC_TcpClientOpts_create(
-	    TunnelConfig_remotehost(ctx->tc),
-	    TunnelConfig_remoteport(ctx->tc));
-    if (!TunnelConfig_server(ctx->tc))
+    if (!Config_numerichosts(cfg))
     {
-	PSC_TcpClientOpts_enableTls(opts,
-		TunnelConfig_certfile(ctx->tc),
-		TunnelConfig_keyfile(ctx->tc));
+	PSC_Event_register(PSC_Connection_nameResolved(cl), cctx,
+		nameresolved, 0);
     }
-    PSC_TcpClientOpts_setProto(opts,
-	    TunnelConfig_clientproto(ctx->tc));
-    PSC_TcpClientOpts_setBlacklistHits(opts,
-	    TunnelConfig_blacklisthits(ctx->tc));
-    if (Config_numerichosts(cfg)) PSC_TcpClientOpts_numericHosts(opts);
-    if (TunnelConfig_noverify(ctx->tc))
-	PSC_TcpClientOpts_disableCertVerify(opts);
 
-    if (PSC_Connection_createTcpClientAsync(opts, cctx, svConnCreated) < 0)
+    if (ctx->passthrough)
     {
-	PSC_Connection_close(cl, 0);
-	free(cctx);
+	PSC_Event_register(PSC_Connection_dataReceived(cl), cctx,
+		helloreceived, 0);
+	PSC_Event_register(PSC_Connection_closed(cl), cctx, helloclosed, 0);
+	cctx->phase = CP_HELLO;
+	if (ctx->hellotimeout)
+	{
+	    WheelTimer_arm(&cctx->timeout, SECS(ctx->hellotimeout));
+	}
+	return;
     }
-    PSC_TcpClientOpts_destroy(opts);
 
-    if (!Config_numerichosts(cfg))
+    PSC_Connection_pause(cl);
+    cctx->route = ctx->routes;
+    connectservice(cctx);
+}
+
+static PSC_TcpClientOpts *createClientOpts(const TunnelConfig *tc)
+{
+    PSC_TcpClientOpts *opts = PSC_TcpClientOpts_create(
+	    TunnelConfig_remotehost(tc),
+	    TunnelConfig_remoteport(tc));
+    if (!TunnelConfig_server(tc) && !TunnelConfig_sni(tc))
     {
-	PSC_Event_register(PSC_Connection_nameResolved(cl), cctx,
-		nameresolved, 0);
+	PSC_TcpClientOpts_enableTls(opts,
+		TunnelConfig_certfile(tc),
+		TunnelConfig_keyfile(tc));
+    }
+    PSC_TcpClientOpts_setProto(opts, TunnelConfig_clientproto(tc));
+    PSC_TcpClientOpts_setBlacklistHits(opts, TunnelConfig_blacklisthits(tc));
+    if (Config_numerichosts(cfg)) PSC_TcpClientOpts_numericHosts(opts);
+    if (TunnelConfig_noverify(tc)) PSC_TcpClientOpts_disableCertVerify(opts);
+    return opts;
+}
+
+static ServCtx *findlistener(const TunnelConfig *tc)
+{
+    for (ServCtx *srv = servers; srv; srv = srv->next)
+    {
+	const TunnelConfig *stc = srv->routes->tc;
+	if (srv->passthrough
+		&& TunnelConfig_bindport(stc) == TunnelConfig_bindport(tc)
+		&& TunnelConfig_serverproto(stc) == TunnelConfig_serverproto(tc)
+		&& !strcmp(TunnelConfig_bindhost(stc), TunnelConfig_bindhost(tc)))
+	{
+	    return srv;
+	}
     }
+    return 0;
 }
 
 static void svprestartup(void *receiver, void *sender, void *args)
@@ -201,9 +495,45 @@ static void svprestartup(void *receiver, void *sender, void *args)
     (void)receiver;
     (void)sender;
 
+    Shaper_init(Config_rate(cfg));
+    Budget_init(Config_memlimit(cfg));
+    LoopLag_init(Config_lagthreshold(cfg));
+
+    ServCtx **nextsrv = &servers;
     const TunnelConfig *tc = Config_tunnel(cfg);
     while (tc)
     {
+	Route *route = PSC_malloc(sizeof *route);
+	route->next = 0;
+	route->tc = tc;
+	route->clientopts = createClientOpts(tc);
+	route->shaper = Shaper_create(TunnelConfig_tunuprate(tc),
+		TunnelConfig_tundownrate(tc), TunnelConfig_weight(tc));
+	route->budget = Budget_create(TunnelConfig_memlimit(tc));
+
+	ServCtx *srv = TunnelConfig_sni(tc) ? findlistener(tc) : 0;
+	if (srv)
+	{
+	    Route *last = srv->routes;
+	    while (last->next) last = last->next;
+	    last->next = route;
+	    if (TunnelConfig_hellotimeout(tc) > srv->hellotimeout)
+	    {
+		srv->hellotimeout = TunnelConfig_hellotimeout(tc);
+	    }
+	    tc = TunnelConfig_next(tc);
+	    continue;
+	}
+
+	srv = PSC_malloc(sizeof *srv);
+	srv->next = 0;
+	srv->server = 0;
+	srv->routes = route;
+	srv->hellotimeout = TunnelConfig_hellotimeout(tc);
+	srv->passthrough = !!TunnelConfig_sni(tc);
+	*nextsrv = srv;
+	nextsrv = &srv->next;
+
 	PSC_TcpServerOpts *opts = PSC_TcpServerOpts_create(
 		TunnelConfig_bindport(tc));
 	PSC_TcpServerOpts_bind(opts, TunnelConfig_bindhost(tc));
@@ -215,22 +545,15 @@ static void svprestartup(void *receiver, void *sender, void *args)
 		    TunnelConfig_keyfile(tc));
 	}
 	if (Config_numerichosts(cfg)) PSC_TcpServerOpts_numericHosts(opts);
-	PSC_Server *server = PSC_Server_createTcp(opts);
+	srv->server = PSC_Server_createTcp(opts);
 	PSC_TcpServerOpts_destroy(opts);
-	if (!server)
+	if (!srv->server)
 	{
 	    PSC_EAStartup_return(args, EXIT_FAILURE);
 	    return;
 	}
-	if (servcapa == servsize)
-	{
-	    servcapa += SERVCHUNK;
-	    servers = PSC_realloc(servers, servcapa * sizeof *servers);
-	}
-	servers[servsize].server = server;
-	servers[servsize].tc = tc;
-	PSC_Event_register(PSC_Server_clientConnected(server),
-		&servers[servsize++], newclient, 0);
+	PSC_Event_register(PSC_Server_clientConnected(srv->server),
+		srv, newclient, 0);
 	tc = TunnelConfig_next(tc);
     }
 }
@@ -241,14 +564,26 @@ static void svshutdown(void *receiver, void *sender, void *args)
     (void)sender;
     (void)args;
 
-    for (size_t i = 0; i < servsize; ++i)
+    while (servers)
     {
-	PSC_Server_destroy(servers[i].server);
+	ServCtx *srv = servers;
+	servers = srv->next;
+	if (srv->server) PSC_Server_destroy(srv->server);
+	while (srv->routes)
+	{
+	    Route *route = srv->routes;
+	    srv->routes = route->next;
+	    PSC_TcpClientOpts_destroy(route->clientopts);
+	    Shaper_destroy(route->shaper);
+	    Budget_destroy(route->budget);
+	    free(route);
+	}
+	free(srv);
     }
-    free(servers);
-    servers = 0;
-    servcapa = 0;
-    servsize = 0;
+    Shaper_done();
+    Budget_done();
+    Wheel_done();
+    LoopLag_done();
 }
 
 SOLOCAL int Tlsc_run(const Config *config)
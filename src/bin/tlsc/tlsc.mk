@@ -1,6 +1,15 @@
-tlsc_MODULES:=	config \
+tlsc_MODULES:=	budget \
+		clienthello \
+		clock \
+		config \
+		looplag \
 		main \
-		tlsc
+		relay \
+		shaper \
+		tlsc \
+		wheel
+
+tlsc_DEFINES:=	-D_POSIX_C_SOURCE=200809L
 
 tlsc_PKGDEPS:=	posercore
 
@@ -0,0 +1,152 @@
+#include "wheel.h"
+#include "clock.h"
+
+#include <poser/core.h>
+
+#define WHEELBITS 6
+#define WHEELSLOTS (1U << WHEELBITS)
+#define WHEELMASK (WHEELSLOTS - 1)
+#define WHEELLEVELS 4
+#define WHEELMAX ((1ULL << (WHEELBITS * WHEELLEVELS)) - 1)
+
+static WheelTimer *slots[WHEELLEVELS][WHEELSLOTS];
+static uint64_t now;
+static size_t armed;
+static PSC_Timer *timer;
+static int ticking;
+
+static void enqueue(WheelTimer *self)
+{
+    uint64_t delta = self->expires - now;
+    int level = 0;
+    while (level < WHEELLEVELS - 1
+	    && delta >= (1ULL << (WHEELBITS * (level + 1)))) ++level;
+    WheelTimer **slot = &slots[level]
+	[(self->expires >> (WHEELBITS * level)) & WHEELMASK];
+    self->prev = 0;
+    self->next = *slot;
+    if (*slot) (*slot)->prev = self;
+    *slot = self;
+}
+
+static void dequeue(WheelTimer *self)
+{
+    if (self->prev) self->prev->next = self->next;
+    else
+    {
+	int level = 0;
+	while (slots[level][(self->expires >> (WHEELBITS * level))
+		& WHEELMASK] != self) ++level;
+	slots[level][(self->expires >> (WHEELBITS * level)) & WHEELMASK]
+	    = self->next;
+    }
+    if (self->next) self->next->prev = self->prev;
+    self->prev = 0;
+    self->next = 0;
+}
+
+static void cascade(int level)
+{
+    WheelTimer **slot = &slots[level]
+	[(now >> (WHEELBITS * level)) & WHEELMASK];
+    WheelTimer *t = *slot;
+    *slot = 0;
+    while (t)
+    {
+	WheelTimer *next = t->next;
+	enqueue(t);
+	t = next;
+    }
+}
+
+static void step(void)
+{
+    ++now;
+    for (int level = 1; level < WHEELLEVELS
+	    && !((now >> (WHEELBITS * (level - 1))) & WHEELMASK); ++level)
+    {
+	cascade(level);
+    }
+
+    WheelTimer **slot = &slots[0][now & WHEELMASK];
+    while (*slot)
+    {
+	WheelTimer *t = *slot;
+	WheelTimer_disarm(t);
+	t->handler(t->obj);
+    }
+}
+
+static void tick(void *receiver, void *sender, void *args)
+{
+    (void)receiver;
+    (void)sender;
+    (void)args;
+
+    uint64_t target = Clock_ms() / WHEELTICK;
+    while (armed && now < target) step();
+    if (now < target) now = target;
+    if (!armed && ticking)
+    {
+	PSC_Timer_stop(timer);
+	ticking = 0;
+    }
+}
+
+SOLOCAL void WheelTimer_init(WheelTimer *self, WheelHandler handler,
+	void *obj)
+{
+    self->prev = 0;
+    self->next = 0;
+    self->handler = handler;
+    self->obj = obj;
+    self->expires = 0;
+}
+
+SOLOCAL void WheelTimer_arm(WheelTimer *self, uint64_t ticks)
+{
+    WheelTimer_disarm(self);
+    if (!ticking)
+    {
+	if (!timer)
+	{
+	    timer = PSC_Timer_create();
+	    PSC_Timer_setMs(timer, WHEELTICK);
+	    PSC_Event_register(PSC_Timer_expired(timer), 0, tick, 0);
+	}
+	now = Clock_ms() / WHEELTICK;
+	PSC_Timer_start(timer, 1);
+	ticking = 1;
+    }
+    if (!ticks) ticks = 1;
+    if (ticks > WHEELMAX) ticks = WHEELMAX;
+    self->expires = now + ticks;
+    enqueue(self);
+    ++armed;
+}
+
+SOLOCAL void WheelTimer_disarm(WheelTimer *self)
+{
+    if (!self->expires) return;
+    dequeue(self);
+    self->expires = 0;
+    --armed;
+}
+
+SOLOCAL int WheelTimer_armed(const WheelTimer *self)
+{
+    return !!self->expires;
+}
+
+SOLOCAL uint64_t Wheel_now(void)
+{
+    return now;
+}
+
+SOLOCAL void Wheel_done(void)
+{
+    if (!timer) return;
+    PSC_Timer_destroy(timer);
+    timer = 0;
+    ticking = 0;
+}
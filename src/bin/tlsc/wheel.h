@@ -0,0 +1,30 @@
+#ifndef TLSC_WHEEL_H
+#define TLSC_WHEEL_H
+
+#include <poser/decl.h>
+
+#include <stdint.h>
+
+#define WHEELTICK 100
+
+typedef void (*WheelHandler)(void *obj);
+
+typedef struct WheelTimer
+{
+    struct WheelTimer *prev;
+    struct WheelTimer *next;
+    WheelHandler handler;
+    void *obj;
+    uint64_t expires;
+} WheelTimer;
+
+void WheelTimer_init(WheelTimer *self, WheelHandler handler, void *obj)
+    ATTR_NONNULL((1)) ATTR_NONNULL((2));
+void WheelTimer_arm(WheelTimer *self, uint64_t ticks) CMETHOD;
+void WheelTimer_disarm(WheelTimer *self) CMETHOD;
+int WheelTimer_armed(const WheelTimer *self) CMETHOD ATTR_PURE;
+
+uint64_t Wheel_now(void) ATTR_PURE;
+void Wheel_done(void);
+
+#endif